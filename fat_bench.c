@@ -0,0 +1,100 @@
+#include "file_reader.h"
+
+#define BENCH_READ_SIZE 16
+#define BENCH_ROUNDS 5
+
+static double bench_seek(struct file_t *file, const int32_t *offsets, size_t iterations) {
+    uint64_t start = trace_clock();
+    for (size_t i = 0; i < iterations; ++i) {
+        file_seek(file, offsets[i], SEEK_SET);
+    }
+    return (double) (trace_clock() - start) / iterations;
+}
+
+static double bench_read(struct file_t *file, const int32_t *offsets, size_t iterations) {
+    char buffer[BENCH_READ_SIZE];
+    uint64_t start = trace_clock();
+    for (size_t i = 0; i < iterations; ++i) {
+        file_seek(file, offsets[i], SEEK_SET);
+        file_read(buffer, 1, BENCH_READ_SIZE, file);
+    }
+    return (double) (trace_clock() - start) / iterations;
+}
+
+static void bench_report(const char *label, double generic, double specialized) {
+    printf("%-20s generic %9.1f ns/call  specialized %9.1f ns/call  saving %7.1f ns/call (%.1f%%)\n", label,
+           generic, specialized, generic - specialized, 100.0 * (generic - specialized) / generic);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "usage: %s <volume_file> <file_name> [iterations]\n", argv[0]);
+        return 1;
+    }
+    size_t iterations = argc == 4 ? strtoul(argv[3], NULL, 10) : 1000000;
+    if (iterations == 0) {
+        iterations = 1;
+    }
+
+    struct disk_t *disk = disk_open_from_file(argv[1]);
+    if (disk == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct volume_t *volume = fat_open(disk, 0);
+    if (volume == NULL) {
+        perror(argv[1]);
+        disk_close(disk);
+        return 1;
+    }
+    struct file_t *file = file_open(volume, argv[2]);
+    if (file == NULL || file->size <= BENCH_READ_SIZE) {
+        fprintf(stderr, "%s: cannot open or shorter than %d bytes\n", argv[2], BENCH_READ_SIZE + 1);
+        if (file != NULL) {
+            file_close(file);
+        }
+        fat_close(volume);
+        disk_close(disk);
+        return 1;
+    }
+
+    int32_t *offsets = malloc(iterations * sizeof(int32_t));
+    if (offsets == NULL) {
+        perror("malloc");
+        file_close(file);
+        fat_close(volume);
+        disk_close(disk);
+        return 1;
+    }
+    // Reads stop short of the end of the file so that none of them raises end_of_file
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < iterations; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        offsets[i] = (int32_t) (state % (file->size - BENCH_READ_SIZE));
+    }
+
+    printf("cluster size %u B, %zu iterations, best of %d rounds\n",
+           volume->super.sectors_per_clusters * volume->super.bytes_per_sector, iterations, BENCH_ROUNDS);
+
+    double seek[2] = {1e300, 1e300};
+    double read[2] = {1e300, 1e300};
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        for (int specialized = 0; specialized < 2; ++specialized) {
+            fat_select_fast_path(volume, specialized);
+            double result = bench_seek(file, offsets, iterations);
+            seek[specialized] = result < seek[specialized] ? result : seek[specialized];
+            result = bench_read(file, offsets, iterations);
+            read[specialized] = result < read[specialized] ? result : read[specialized];
+        }
+    }
+    bench_report("file_seek", seek[0], seek[1]);
+    bench_report("file_seek+file_read", read[0], read[1]);
+
+    free(offsets);
+    file_close(file);
+    fat_close(volume);
+    disk_close(disk);
+    return 0;
+}
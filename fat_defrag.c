@@ -0,0 +1,38 @@
+#include "file_reader.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <volume_file> [defragmented_volume_file]\n", argv[0]);
+        return 1;
+    }
+
+    struct disk_t *disk = disk_open_from_file(argv[1]);
+    if (disk == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct volume_t *volume = fat_open(disk, 0);
+    if (volume == NULL) {
+        perror(argv[1]);
+        disk_close(disk);
+        return 1;
+    }
+
+    int result = 0;
+    if (fat_fragmentation_print(volume, stdout) != 0) {
+        perror("fat_fragmentation_print");
+        result = 1;
+    }
+    if (result == 0 && argc == 3) {
+        if (fat_defragment(volume, argv[2]) != 0) {
+            perror(argv[2]);
+            result = 1;
+        } else {
+            printf("\ndefragmented volume written to %s\n", argv[2]);
+        }
+    }
+
+    fat_close(volume);
+    disk_close(disk);
+    return result;
+}
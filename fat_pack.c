@@ -0,0 +1,48 @@
+#include "file_reader.h"
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "usage: %s <source_directory> <volume_file> [sectors_per_cluster]\n", argv[0]);
+        return 1;
+    }
+
+    struct pack_options_t options = {0};
+    if (argc == 4) {
+        char *end = NULL;
+        unsigned long sectors_per_cluster = strtoul(argv[3], &end, 10);
+        if (*argv[3] == '\0' || *end != '\0' || sectors_per_cluster < 1 || sectors_per_cluster > 64) {
+            fprintf(stderr, "%s: sectors_per_cluster must be between 1 and 64\n", argv[0]);
+            return 1;
+        }
+        options.sectors_per_cluster = (uint8_t) sectors_per_cluster;
+    }
+
+    char failed_path[PATH_MAX];
+    if (fat_pack(argv[1], argv[2], &options, failed_path, sizeof(failed_path)) != 0) {
+        perror(failed_path);
+        return 1;
+    }
+
+    struct disk_t *disk = disk_open_from_file(argv[2]);
+    if (disk == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    struct volume_t *volume = fat_open(disk, 0);
+    if (volume == NULL) {
+        perror(argv[2]);
+        disk_close(disk);
+        return 1;
+    }
+
+    struct fragmentation_t info;
+    if (fat_fragmentation(volume, &info) == 0) {
+        printf("%s: %" PRIu32 " files, %" PRIu32 " directories, %" PRIu32 " clusters of %d bytes, %" PRIu32
+               " extents\n", argv[2], info.files, info.directories, info.clusters,
+               volume->super.sectors_per_clusters * volume->super.bytes_per_sector, info.extents);
+    }
+
+    fat_close(volume);
+    disk_close(disk);
+    return 0;
+}
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+
+#include "file_reader.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 512
+
+enum backend_t {
+    BACKEND_STDIO,
+    BACKEND_PREAD
+};
+
+struct replay_options_t {
+    enum backend_t backend; //disk_read on a stdio stream, or plain pread(2) on a descriptor
+    size_t buffer_size; //stdio buffer size, 0 disables buffering. disk_read rewinds the stream after every read,
+                        //so the buffer rarely serves more than the read that filled it
+    bool cold; //Drop the image from the page cache before every pass
+    int repeat; //Number of passes over the trace
+};
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t size, double p) {
+    if (size == 0) {
+        return 0;
+    }
+    size_t index = (size_t) (p * (double) (size - 1) + 0.5);
+    return sorted[index];
+}
+
+static void print_latencies(const char *label, uint64_t *samples, size_t size) {
+    qsort(samples, size, sizeof(uint64_t), compare_u64);
+    printf("%-10s %8zu  p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f us\n", label, size,
+           percentile(samples, size, 0.5) / 1000.0, percentile(samples, size, 0.9) / 1000.0,
+           percentile(samples, size, 0.99) / 1000.0, percentile(samples, size, 0.999) / 1000.0,
+           size == 0 ? 0.0 : samples[size - 1] / 1000.0);
+}
+
+static struct trace_record_t *load_trace(const char *trace_file_name, size_t *size) {
+    FILE *fp = fopen(trace_file_name, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    struct trace_header_t header;
+    if (fread(&header, sizeof(struct trace_header_t), 1, fp) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION ||
+        header.record_size != sizeof(struct trace_record_t)) {
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t capacity = 1024;
+    struct trace_record_t *records = malloc(capacity * sizeof(struct trace_record_t));
+    *size = 0;
+    while (records != NULL) {
+        if (*size == capacity) {
+            capacity *= 2;
+            struct trace_record_t *temp = realloc(records, capacity * sizeof(struct trace_record_t));
+            if (temp == NULL) {
+                free(records);
+                records = NULL;
+                break;
+            }
+            records = temp;
+        }
+        size_t readed = fread(records + *size, sizeof(struct trace_record_t), capacity - *size, fp);
+        *size += readed;
+        if (readed == 0) {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return records;
+}
+
+static void print_recorded(const struct trace_record_t *records, size_t size) {
+    static const char *names[] = {NULL, "disk_read", "file_open", "file_read", "file_seek", "dir_read"};
+    uint64_t *samples = malloc((size == 0 ? 1 : size) * sizeof(uint64_t));
+    if (samples == NULL) {
+        return;
+    }
+
+    printf("recorded:\n");
+    for (uint8_t op = TRACE_DISK_READ; op <= TRACE_DIR_READ; ++op) {
+        size_t count = 0;
+        for (size_t i = 0; i < size; ++i) {
+            if (records[i].op == op) {
+                samples[count++] = records[i].duration;
+            }
+        }
+        if (count != 0) {
+            print_latencies(names[op], samples, count);
+        }
+    }
+
+    free(samples);
+}
+
+static int replay(const char *volume_file_name, const struct trace_record_t *records, size_t size,
+                  const struct replay_options_t *options) {
+    size_t reads = 0;
+    int32_t max_sectors = 1;
+    for (size_t i = 0; i < size; ++i) {
+        if (records[i].op == TRACE_DISK_READ) {
+            reads++;
+            if (records[i].count > max_sectors) {
+                max_sectors = records[i].count;
+            }
+        }
+    }
+
+    uint8_t *buffer = malloc((size_t) max_sectors * SECTOR_SIZE);
+    uint64_t *samples = malloc((reads * options->repeat + 1) * sizeof(uint64_t));
+    if (buffer == NULL || samples == NULL) {
+        free(buffer);
+        free(samples);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct disk_t *disk = NULL;
+    char *stdio_buffer = NULL;
+    int fd = -1;
+    if (options->backend == BACKEND_STDIO) {
+        // glibc ignores the requested size unless the buffer is supplied
+        if (options->buffer_size != 0 && (stdio_buffer = malloc(options->buffer_size)) == NULL) {
+            free(buffer);
+            free(samples);
+            errno = ENOMEM;
+            return -1;
+        }
+        disk = disk_open_from_file(volume_file_name);
+        if (disk != NULL) {
+            setvbuf(disk->disk, stdio_buffer, stdio_buffer == NULL ? _IONBF : _IOFBF, options->buffer_size);
+            fd = fileno(disk->disk);
+        }
+    } else {
+        fd = open(volume_file_name, O_RDONLY);
+    }
+    if (fd < 0) {
+        free(stdio_buffer);
+        free(buffer);
+        free(samples);
+        return -1;
+    }
+
+    size_t replayed = 0;
+    size_t failed = 0;
+    uint64_t bytes = 0;
+    uint64_t elapsed = 0;
+    for (int pass = 0; pass < options->repeat; ++pass) {
+        if (options->cold) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        uint64_t pass_start = trace_clock();
+        for (size_t i = 0; i < size; ++i) {
+            if (records[i].op != TRACE_DISK_READ) {
+                continue;
+            }
+            size_t length = (size_t) records[i].count * SECTOR_SIZE;
+            uint64_t start = trace_clock();
+            int ok;
+            if (disk != NULL) {
+                ok = disk_read(disk, records[i].first, buffer, records[i].count) == records[i].count;
+            } else {
+                ok = pread(fd, buffer, length, (off_t) records[i].first * SECTOR_SIZE) == (ssize_t) length;
+            }
+            samples[replayed++] = trace_clock() - start;
+            if (ok) {
+                bytes += length;
+            } else {
+                failed++;
+            }
+        }
+        elapsed += trace_clock() - pass_start;
+    }
+
+    if (disk != NULL) {
+        disk_close(disk);
+    } else {
+        close(fd);
+    }
+    free(stdio_buffer);
+
+    printf("replayed:\n");
+    print_latencies("disk_read", samples, replayed);
+    printf("%zu reads (%zu failed), %" PRIu64 " bytes in %.3f ms, %.2f MiB/s\n", replayed, failed, bytes,
+           elapsed / 1e6, elapsed == 0 ? 0.0 : (bytes / (1024.0 * 1024.0)) / (elapsed / 1e9));
+
+    free(buffer);
+    free(samples);
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s <trace_file> <volume_file> [--backend stdio|pread] [--buffer bytes] [--cold] "
+                    "[--repeat n]\n"
+                    "  --buffer  stdio buffer size for the stdio backend, 0 for unbuffered; disk_read seeks back to\n"
+                    "            the start of the image after every read, so a larger buffer may change little\n"
+                    "            across separate reads\n", name);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct replay_options_t options = {.backend = BACKEND_STDIO, .buffer_size = BUFSIZ, .cold = false, .repeat = 1};
+    bool buffer_given = false;
+    for (int i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "stdio") == 0) {
+                options.backend = BACKEND_STDIO;
+            } else if (strcmp(argv[i], "pread") == 0) {
+                options.backend = BACKEND_PREAD;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc) {
+            options.buffer_size = strtoul(argv[++i], NULL, 10);
+            buffer_given = true;
+        } else if (strcmp(argv[i], "--cold") == 0) {
+            options.cold = true;
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            options.repeat = atoi(argv[++i]);
+            if (options.repeat < 1) {
+                options.repeat = 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (buffer_given && options.backend != BACKEND_STDIO) {
+        fprintf(stderr, "%s: --buffer only applies to the stdio backend\n", argv[0]);
+        return 1;
+    }
+
+    size_t size = 0;
+    struct trace_record_t *records = load_trace(argv[1], &size);
+    if (records == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    print_recorded(records, size);
+    if (replay(argv[2], records, size, &options) != 0) {
+        perror(argv[2]);
+        free(records);
+        return 1;
+    }
+
+    free(records);
+    return 0;
+}
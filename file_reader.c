@@ -1,7 +1,106 @@
+#define _GNU_SOURCE
+
 #include "file_reader.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #define SET_ERRNO(x) errno = x
 
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+
+uint64_t trace_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+struct trace_t *trace_open(const char *trace_file_name) {
+    if (trace_file_name == NULL) {
+        SET_ERRNO(EFAULT);
+        return NULL;
+    }
+    struct trace_t *trace = calloc(1, sizeof(struct trace_t));
+    if (trace == NULL) {
+        SET_ERRNO(ENOMEM);
+        return NULL;
+    }
+    trace->trace = fopen(trace_file_name, "wb");
+    if (trace->trace == NULL) {
+        free(trace);
+        SET_ERRNO(ENOENT);
+        return NULL;
+    }
+    setvbuf(trace->trace, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    struct trace_header_t header = {.version = TRACE_VERSION, .record_size = sizeof(struct trace_record_t)};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(struct trace_header_t), 1, trace->trace) != 1) {
+        fclose(trace->trace);
+        free(trace);
+        SET_ERRNO(EIO);
+        return NULL;
+    }
+
+    trace->next_handle = 1;
+    trace->start = trace_clock();
+    return trace;
+}
+
+int trace_close(struct trace_t *ptrace) {
+    if (ptrace == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    // A disk still pointing at the trace would write through a freed pointer
+    if (ptrace->attached != 0) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    int result = fclose(ptrace->trace);
+    uint64_t dropped = ptrace->dropped;
+    free(ptrace);
+    if (result != 0 || dropped != 0) {
+        SET_ERRNO(EIO);
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint16_t trace_next_handle(struct trace_t *ptrace) {
+    uint16_t handle = ptrace->next_handle++;
+    if (ptrace->next_handle == 0) {
+        ptrace->next_handle = 1;
+    }
+    return handle;
+}
+
+static void trace_write(struct trace_t *ptrace, enum trace_op_t op, int whence, uint16_t handle, int32_t first,
+                        int32_t count, int32_t result, uint64_t start) {
+    uint64_t duration = trace_clock() - start;
+    struct trace_record_t record = {
+            .op = op,
+            .whence = (uint8_t) whence,
+            .handle = handle,
+            .first = first,
+            .count = count,
+            .result = result,
+            .timestamp = start - ptrace->start,
+            .duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t) duration
+    };
+    if (fwrite(&record, sizeof(struct trace_record_t), 1, ptrace->trace) == 1) {
+        ptrace->records++;
+    } else {
+        ptrace->dropped++;
+    }
+}
+
 
 struct disk_t *disk_open_from_file(const char *volume_file_name) {
     if (volume_file_name == NULL) {
@@ -22,10 +121,11 @@ struct disk_t *disk_open_from_file(const char *volume_file_name) {
     }
 
     disk->disk = fp;
+    disk->trace = NULL;
     return disk;
 }
 
-int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
+static int disk_read_untraced(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
     if (pdisk == NULL || pdisk->disk == NULL || buffer == NULL) {
         SET_ERRNO(EFAULT);
         return -1;
@@ -43,18 +143,47 @@ int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t
     return sectors_to_read;
 }
 
+int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
+    if (pdisk == NULL || pdisk->trace == NULL) {
+        return disk_read_untraced(pdisk, first_sector, buffer, sectors_to_read);
+    }
+
+    uint64_t start = trace_clock();
+    int result = disk_read_untraced(pdisk, first_sector, buffer, sectors_to_read);
+    trace_write(pdisk->trace, TRACE_DISK_READ, 0, 0, first_sector, sectors_to_read, result, start);
+    return result;
+}
+
 int disk_close(struct disk_t *pdisk) {
     if (pdisk == NULL) {
         SET_ERRNO(EFAULT);
         return -1;
     }
 
+    disk_set_trace(pdisk, NULL);
     fclose(pdisk->disk);
     free(pdisk);
 
     return 0;
 }
 
+int disk_set_trace(struct disk_t *pdisk, struct trace_t *ptrace) {
+    if (pdisk == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    if (pdisk->trace != NULL) {
+        pdisk->trace->attached--;
+    }
+    pdisk->trace = ptrace;
+    if (ptrace != NULL) {
+        ptrace->attached++;
+    }
+
+    return 0;
+}
+
 
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
     if (pdisk == NULL || pdisk->disk == NULL) {
@@ -96,6 +225,7 @@ struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
                             volume->root_dir_sectors);
     volume->total_clusters = volume->total_sectors / volume->super.sectors_per_clusters;
     volume->disk = pdisk;
+    fat_select_fast_path(volume, true);
 
     return volume;
 }
@@ -162,7 +292,7 @@ struct clusters_chain_t *get_chain_fat16(struct volume_t *volume, size_t size, u
 }
 
 
-struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
+static struct file_t *file_open_untraced(struct volume_t *pvolume, const char *file_name) {
     if (pvolume == NULL || file_name == NULL) {
         SET_ERRNO(EFAULT);
         return NULL;
@@ -244,6 +374,7 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
             file->file_offset = 0;
             file->cluster_offset = 0;
             file->end_of_file = false;
+            file->handle = 0;
             free(buffer);
             return file;
         }
@@ -255,6 +386,23 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
     return NULL;
 }
 
+struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
+    if (pvolume == NULL || pvolume->disk == NULL || pvolume->disk->trace == NULL) {
+        return file_open_untraced(pvolume, file_name);
+    }
+
+    uint64_t start = trace_clock();
+    struct file_t *file = file_open_untraced(pvolume, file_name);
+    if (file == NULL) {
+        trace_write(pvolume->disk->trace, TRACE_FILE_OPEN, 0, 0, 0, 0, -1, start);
+        return NULL;
+    }
+    file->handle = trace_next_handle(pvolume->disk->trace);
+    trace_write(pvolume->disk->trace, TRACE_FILE_OPEN, 0, file->handle, file->low_order_address_of_first_cluster,
+                (int32_t) file->size, 0, start);
+    return file;
+}
+
 int file_close(struct file_t *stream) {
     if (stream == NULL) {
         SET_ERRNO(EFAULT);
@@ -270,7 +418,11 @@ int file_close(struct file_t *stream) {
     return 0;
 }
 
-size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+// Shared body of every file_read implementation. The fast paths pass compile time constants,
+// so the cluster arithmetic below turns into shifts and masks.
+static inline __attribute__((always_inline)) size_t
+file_read_cluster(void *ptr, size_t size, size_t nmemb, struct file_t *stream, uint32_t cluster_size,
+                  uint32_t sectors_per_cluster) {
     if (ptr == NULL || size == 0 || nmemb == 0 || stream == NULL) {
         SET_ERRNO(EFAULT);
         return -1;
@@ -280,11 +432,11 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
         return 0;
     }
     size_t how_many_elements = 0;
-    uint8_t *buffer = calloc(stream->volume->super.sectors_per_clusters, 512);
+    uint8_t *buffer = calloc(sectors_per_cluster, 512);
     uint32_t first_sector =
-            ((stream->chain->clusters[stream->file_offset] - 2) * stream->volume->super.sectors_per_clusters) +
+            ((stream->chain->clusters[stream->file_offset] - 2) * sectors_per_cluster) +
             stream->volume->first_data_sector;
-    if (disk_read(stream->volume->disk, first_sector, buffer, stream->volume->super.sectors_per_clusters) == -1) {
+    if (disk_read(stream->volume->disk, first_sector, buffer, sectors_per_cluster) == -1) {
         free(buffer);
         return how_many_elements;
     }
@@ -294,21 +446,15 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
     size_t buffer_offset = 0;
 
     for (size_t i = 0; i < nmemb; ++i) {
-        if (stream->file_offset * stream->volume->super.sectors_per_clusters * stream->volume->super.bytes_per_sector +
-            stream->cluster_offset >= stream->size) {
+        if (stream->file_offset * cluster_size + stream->cluster_offset >= stream->size) {
             free(buffer);
             return 0;
         }
-        if (stream->size >=
-            ((file_offset * stream->volume->super.sectors_per_clusters * stream->volume->super.bytes_per_sector) +
-             cluster_offset + size)) {
-            if (cluster_offset < stream->volume->super.sectors_per_clusters * stream->volume->super.bytes_per_sector) {
+        if (stream->size >= file_offset * cluster_size + cluster_offset + size) {
+            if (cluster_offset < cluster_size) {
                 uint8_t how_much_to_copy = 0;
-                if ((cluster_offset + size >
-                     stream->volume->super.sectors_per_clusters * stream->volume->super.bytes_per_sector)) {
-                    how_much_to_copy =
-                            (stream->volume->super.sectors_per_clusters * stream->volume->super.bytes_per_sector) -
-                            cluster_offset;
+                if (cluster_offset + size > cluster_size) {
+                    how_much_to_copy = cluster_size - cluster_offset;
                     memcpy((char *) ptr + buffer_offset, buffer + cluster_offset, how_much_to_copy);
                     cluster_offset += how_much_to_copy;
                     buffer_offset += how_much_to_copy;
@@ -316,11 +462,9 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
                     file_offset++;
 
                     first_sector =
-                            ((stream->chain->clusters[file_offset] - 2) * stream->volume->super.sectors_per_clusters) +
+                            ((stream->chain->clusters[file_offset] - 2) * sectors_per_cluster) +
                             stream->volume->first_data_sector;
-                    if (disk_read(stream->volume->disk, first_sector, buffer,
-                                  stream->volume->super.sectors_per_clusters) ==
-                        -1) {
+                    if (disk_read(stream->volume->disk, first_sector, buffer, sectors_per_cluster) == -1) {
                         free(buffer);
                         return nmemb;
                     }
@@ -338,10 +482,9 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
                 file_offset++;
                 cluster_offset = 0;
                 first_sector =
-                        ((stream->chain->clusters[file_offset] - 2) * stream->volume->super.sectors_per_clusters) +
+                        ((stream->chain->clusters[file_offset] - 2) * sectors_per_cluster) +
                         stream->volume->first_data_sector;
-                if (disk_read(stream->volume->disk, first_sector, buffer, stream->volume->super.sectors_per_clusters) ==
-                    -1) {
+                if (disk_read(stream->volume->disk, first_sector, buffer, sectors_per_cluster) == -1) {
                     free(buffer);
                     return nmemb;
                 }
@@ -350,22 +493,15 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
                 cluster_offset += size;
                 buffer_offset += size;
             }
-        } else if (stream->size ==
-                   ((file_offset * stream->volume->super.sectors_per_clusters *
-                     stream->volume->super.bytes_per_sector) +
-                    cluster_offset + size)) {
+        } else if (stream->size == file_offset * cluster_size + cluster_offset + size) {
             memcpy((char *) ptr + buffer_offset, buffer + cluster_offset, size);
             how_many_elements++;
             cluster_offset += size;
             buffer_offset += size;
             stream->end_of_file = true;
             break;
-        } else if ((stream->size - ((file_offset * stream->volume->super.sectors_per_clusters *
-                                     stream->volume->super.bytes_per_sector) +
-                                    cluster_offset)) < size) {
-            int how_many = stream->size - ((file_offset * stream->volume->super.sectors_per_clusters *
-                                            stream->volume->super.bytes_per_sector) +
-                                           cluster_offset);
+        } else if ((stream->size - (file_offset * cluster_size + cluster_offset)) < size) {
+            int how_many = stream->size - (file_offset * cluster_size + cluster_offset);
             memcpy((char *) ptr + buffer_offset, buffer + cluster_offset, how_many);
             cluster_offset += how_many;
             stream->end_of_file = true;
@@ -384,50 +520,140 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
     return how_many_elements;
 }
 
+static size_t file_read_untraced(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+    if (stream == NULL || stream->volume == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    return stream->volume->file_read(ptr, size, nmemb, stream);
+}
 
-int32_t file_seek(struct file_t *stream, int32_t offset, int whence) {
+size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+    if (stream == NULL || stream->disk == NULL || stream->disk->trace == NULL) {
+        return file_read_untraced(ptr, size, nmemb, stream);
+    }
+
+    uint64_t start = trace_clock();
+    size_t result = file_read_untraced(ptr, size, nmemb, stream);
+    trace_write(stream->disk->trace, TRACE_FILE_READ, 0, stream->handle, (int32_t) size, (int32_t) nmemb,
+                (int32_t) result, start);
+    return result;
+}
+
+
+// Shared body of every file_seek implementation, see file_read_cluster
+static inline __attribute__((always_inline)) int32_t
+file_seek_cluster(struct file_t *stream, int32_t offset, int whence, uint32_t cluster_size) {
     if (stream == NULL) {
         SET_ERRNO(EFAULT);
         return -1;
     }
 
+    // Targets are range checked as signed values before the unsigned cluster arithmetic
+    int64_t target;
     if (whence == SEEK_SET) {
-        if (offset > (int32_t) stream->size) {
-            SET_ERRNO(ENXIO);
-            return -1;
-        }
-        stream->file_offset = (int) (offset / (stream->volume->super.sectors_per_clusters *
-                                               stream->volume->super.bytes_per_sector));
-        if (stream->file_offset != 0) {
-            stream->cluster_offset = offset % (stream->file_offset * (stream->volume->super.sectors_per_clusters *
-                                                                      stream->volume->super.bytes_per_sector));
-        } else {
-            stream->cluster_offset = offset;
-        }
-
+        target = offset;
     } else if (whence == SEEK_END) {
-        if ((uint32_t) abs(offset) > stream->size) {
-            SET_ERRNO(ENXIO);
-            return -1;
-        }
-        int bytes_from_beginning = stream->size + offset;
-        stream->file_offset = (int) (bytes_from_beginning / (stream->volume->super.sectors_per_clusters *
-                                                             stream->volume->super.bytes_per_sector));
-        stream->cluster_offset =
-                bytes_from_beginning % (stream->file_offset * (stream->volume->super.sectors_per_clusters *
-                                                               stream->volume->super.bytes_per_sector));
+        target = (int64_t) stream->size + offset;
     } else if (whence == SEEK_CUR) {
-        uint32_t current_bytes = (stream->volume->super.sectors_per_clusters * stream->volume->super.bytes_per_sector) *
-                                 stream->file_offset + stream->cluster_offset;
-        if ((current_bytes + offset) <= 0 || current_bytes + offset > stream->size) {
-            SET_ERRNO(ENXIO);
-            return -1;
+        target = (int64_t) cluster_size * stream->file_offset + stream->cluster_offset + offset;
+    } else {
+        return 0;
+    }
+    if (target < 0 || target > (int64_t) stream->size) {
+        SET_ERRNO(ENXIO);
+        return -1;
+    }
+
+    stream->file_offset = (uint32_t) target / cluster_size;
+    stream->cluster_offset = (uint32_t) target % cluster_size;
+
+    return 0;
+}
+
+static int32_t file_seek_untraced(struct file_t *stream, int32_t offset, int whence) {
+    if (stream == NULL || stream->volume == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    return stream->volume->file_seek(stream, offset, whence);
+}
+
+int32_t file_seek(struct file_t *stream, int32_t offset, int whence) {
+    if (stream == NULL || stream->disk == NULL || stream->disk->trace == NULL) {
+        return file_seek_untraced(stream, offset, whence);
+    }
+
+    uint64_t start = trace_clock();
+    int32_t result = file_seek_untraced(stream, offset, whence);
+    trace_write(stream->disk->trace, TRACE_FILE_SEEK, whence, stream->handle, offset, 0, result, start);
+    return result;
+}
+
+
+static size_t file_read_generic(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+    return file_read_cluster(ptr, size, nmemb, stream,
+                             stream->volume->super.sectors_per_clusters * stream->volume->super.bytes_per_sector,
+                             stream->volume->super.sectors_per_clusters);
+}
+
+static int32_t file_seek_generic(struct file_t *stream, int32_t offset, int whence) {
+    return file_seek_cluster(stream, offset, whence,
+                             stream->volume->super.sectors_per_clusters * stream->volume->super.bytes_per_sector);
+}
+
+// One file_read/file_seek pair per cluster size of a volume with 512 B sectors
+#define DEFINE_CLUSTER_FAST_PATH(shift)                                                                 \
+    static size_t file_read_##shift(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {     \
+        return file_read_cluster(ptr, size, nmemb, stream, 1u << (shift), 1u << ((shift) - 9));        \
+    }                                                                                                   \
+    static int32_t file_seek_##shift(struct file_t *stream, int32_t offset, int whence) {              \
+        return file_seek_cluster(stream, offset, whence, 1u << (shift));                               \
+    }
+
+DEFINE_CLUSTER_FAST_PATH(9)
+DEFINE_CLUSTER_FAST_PATH(10)
+DEFINE_CLUSTER_FAST_PATH(11)
+DEFINE_CLUSTER_FAST_PATH(12)
+DEFINE_CLUSTER_FAST_PATH(13)
+DEFINE_CLUSTER_FAST_PATH(14)
+DEFINE_CLUSTER_FAST_PATH(15)
+
+static const struct {
+    size_t (*file_read)(void *ptr, size_t size, size_t nmemb, struct file_t *stream);
+    int32_t (*file_seek)(struct file_t *stream, int32_t offset, int whence);
+} cluster_fast_paths[] = {
+        {file_read_9,  file_seek_9},
+        {file_read_10, file_seek_10},
+        {file_read_11, file_seek_11},
+        {file_read_12, file_seek_12},
+        {file_read_13, file_seek_13},
+        {file_read_14, file_seek_14},
+        {file_read_15, file_seek_15}
+};
+
+int fat_select_fast_path(struct volume_t *pvolume, bool specialized) {
+    if (pvolume == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    uint32_t cluster_size = pvolume->super.sectors_per_clusters * pvolume->super.bytes_per_sector;
+    pvolume->cluster_shift = 0;
+    if (cluster_size != 0 && (cluster_size & (cluster_size - 1)) == 0) {
+        while ((1u << pvolume->cluster_shift) < cluster_size) {
+            pvolume->cluster_shift++;
         }
-        stream->file_offset = (int) (offset + current_bytes) / (stream->volume->super.sectors_per_clusters *
-                                                                stream->volume->super.bytes_per_sector);
-        stream->cluster_offset =
-                (offset + current_bytes) % (stream->file_offset * (stream->volume->super.sectors_per_clusters *
-                                                                   stream->volume->super.bytes_per_sector));
+    }
+
+    pvolume->file_read = file_read_generic;
+    pvolume->file_seek = file_seek_generic;
+    if (specialized && pvolume->super.bytes_per_sector == 512 && pvolume->cluster_shift >= 9 &&
+        pvolume->cluster_shift <= 15) {
+        pvolume->file_read = cluster_fast_paths[pvolume->cluster_shift - 9].file_read;
+        pvolume->file_seek = cluster_fast_paths[pvolume->cluster_shift - 9].file_seek;
     }
 
     return 0;
@@ -451,6 +677,10 @@ struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
     if (dir_path[0] == '\\') {
         dir->disk = pvolume->disk;
         dir->dir_offset = 0;
+        dir->handle = 0;
+        if (pvolume->disk != NULL && pvolume->disk->trace != NULL) {
+            dir->handle = trace_next_handle(pvolume->disk->trace);
+        }
         return dir;
     }
 
@@ -458,7 +688,7 @@ struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
     return NULL;
 }
 
-int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
+static int dir_read_untraced(struct dir_t *pdir, struct dir_entry_t *pentry) {
     if (pdir == NULL || pentry == NULL) {
         SET_ERRNO(EFAULT);
         return -1;
@@ -527,6 +757,18 @@ int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
     return 1;
 }
 
+int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
+    if (pdir == NULL || pdir->disk == NULL || pdir->disk->trace == NULL) {
+        return dir_read_untraced(pdir, pentry);
+    }
+
+    uint64_t start = trace_clock();
+    uint32_t dir_offset = pdir->dir_offset;
+    int result = dir_read_untraced(pdir, pentry);
+    trace_write(pdir->disk->trace, TRACE_DIR_READ, 0, pdir->handle, (int32_t) dir_offset, 1, result, start);
+    return result;
+}
+
 int dir_close(struct dir_t *pdir) {
     if (pdir == NULL) {
         SET_ERRNO(EFAULT);
@@ -539,3 +781,1094 @@ int dir_close(struct dir_t *pdir) {
 
     return 0;
 }
+
+
+#define DEFRAG_BUFFER_CLUSTERS 64
+
+struct fat_node_t {
+    struct SFN *entry; //Entry inside the parent directory data, NULL for the root directory
+    struct clusters_chain_t *chain;
+    uint8_t *data; //Directory content, NULL for regular files
+    size_t data_size;
+    size_t parent;
+    uint16_t new_first_cluster;
+    char path[256];
+};
+
+struct fat_tree_t {
+    struct fat_node_t *nodes;
+    size_t size;
+    size_t capacity;
+    uint16_t *fat;
+    uint32_t max_cluster;
+    uint32_t cluster_size;
+};
+
+static uint16_t *fat_load_table(struct volume_t *volume) {
+    uint16_t *fat = calloc(volume->super.size_of_fat, volume->super.bytes_per_sector);
+    if (fat == NULL) {
+        SET_ERRNO(ENOMEM);
+        return NULL;
+    }
+
+    if (disk_read(volume->disk, volume->first_fat_sector, fat, volume->super.size_of_fat) !=
+        volume->super.size_of_fat) {
+        free(fat);
+        SET_ERRNO(EINVAL);
+        return NULL;
+    }
+
+    return fat;
+}
+
+static struct clusters_chain_t *fat_chain_from_table(const struct fat_tree_t *tree, uint16_t first_cluster) {
+    struct clusters_chain_t *chain = calloc(1, sizeof(struct clusters_chain_t));
+    if (chain == NULL) {
+        SET_ERRNO(ENOMEM);
+        return NULL;
+    }
+    if (first_cluster < 2) {
+        return chain;
+    }
+
+    size_t how_many_clusters = 0;
+    uint16_t next_index = first_cluster;
+    while (next_index < EOC_FAT_16) {
+        if (next_index < 2 || next_index > tree->max_cluster || how_many_clusters > tree->max_cluster) {
+            free(chain);
+            SET_ERRNO(EINVAL);
+            return NULL;
+        }
+        next_index = tree->fat[next_index];
+        how_many_clusters++;
+    }
+
+    chain->clusters = malloc(how_many_clusters * sizeof(uint32_t));
+    if (chain->clusters == NULL) {
+        free(chain);
+        SET_ERRNO(ENOMEM);
+        return NULL;
+    }
+
+    next_index = first_cluster;
+    while (chain->size < how_many_clusters) {
+        chain->clusters[chain->size++] = next_index;
+        next_index = tree->fat[next_index];
+    }
+
+    return chain;
+}
+
+static int fat_read_clusters(struct volume_t *volume, const uint32_t *clusters, size_t count, uint8_t *buffer) {
+    uint8_t sectors_per_cluster = volume->super.sectors_per_clusters;
+    size_t cluster_size = sectors_per_cluster * volume->super.bytes_per_sector;
+
+    // Consecutive clusters are fetched with a single read
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && clusters[i + run] == clusters[i] + run) {
+            run++;
+        }
+        int32_t first_sector = (clusters[i] - 2) * sectors_per_cluster + volume->first_data_sector;
+        if (disk_read(volume->disk, first_sector, buffer + i * cluster_size, run * sectors_per_cluster) !=
+            (int) (run * sectors_per_cluster)) {
+            return -1;
+        }
+        i += run;
+    }
+
+    return 0;
+}
+
+static void sfn_to_name(const struct SFN *entry, char *name) {
+    int length = 0;
+    for (int i = 0; i < 8 && entry->filename[i] != ' '; ++i) {
+        name[length++] = (char) entry->filename[i];
+    }
+    if (length > 0 && (unsigned char) name[0] == 0x05) {
+        name[0] = (char) 0xE5;
+    }
+    if (entry->extension[0] != ' ') {
+        name[length++] = '.';
+        for (int i = 0; i < 3 && entry->extension[i] != ' '; ++i) {
+            name[length++] = (char) entry->extension[i];
+        }
+    }
+    name[length] = '\0';
+}
+
+static void fat_tree_free(struct fat_tree_t *tree) {
+    for (size_t i = 0; i < tree->size; ++i) {
+        if (tree->nodes[i].chain != NULL) {
+            free(tree->nodes[i].chain->clusters);
+            free(tree->nodes[i].chain);
+        }
+        free(tree->nodes[i].data);
+    }
+    free(tree->nodes);
+    free(tree->fat);
+    memset(tree, 0, sizeof(struct fat_tree_t));
+}
+
+static int fat_tree_push(struct fat_tree_t *tree, const struct fat_node_t *node) {
+    if (tree->size == tree->capacity) {
+        size_t capacity = tree->capacity == 0 ? 16 : tree->capacity * 2;
+        struct fat_node_t *nodes = realloc(tree->nodes, capacity * sizeof(struct fat_node_t));
+        if (nodes == NULL) {
+            SET_ERRNO(ENOMEM);
+            return -1;
+        }
+        tree->nodes = nodes;
+        tree->capacity = capacity;
+    }
+    tree->nodes[tree->size++] = *node;
+    return 0;
+}
+
+// Loads every directory of the volume into memory, breadth first. Node 0 is the root directory.
+static int fat_tree_load(struct volume_t *volume, struct fat_tree_t *tree) {
+    memset(tree, 0, sizeof(struct fat_tree_t));
+
+    tree->fat = fat_load_table(volume);
+    if (tree->fat == NULL) {
+        return -1;
+    }
+    tree->cluster_size = volume->super.sectors_per_clusters * volume->super.bytes_per_sector;
+    tree->max_cluster = volume->data_sectors / volume->super.sectors_per_clusters + 1;
+    uint32_t fat_entries = volume->super.size_of_fat * volume->super.bytes_per_sector / 2;
+    if (tree->max_cluster >= fat_entries) {
+        tree->max_cluster = fat_entries - 1;
+    }
+
+    struct fat_node_t root = {0};
+    root.data = calloc(volume->root_dir_sectors, volume->super.bytes_per_sector);
+    if (root.data == NULL) {
+        fat_tree_free(tree);
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+    root.data_size = volume->super.maximum_number_of_files * 32;
+    int root_dir = volume->super.size_of_reserved_area + volume->super.size_of_fat * volume->super.number_of_fats;
+    if (disk_read(volume->disk, root_dir, root.data, volume->root_dir_sectors) != volume->root_dir_sectors ||
+        fat_tree_push(tree, &root) != 0) {
+        free(root.data);
+        fat_tree_free(tree);
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    // One bit per cluster, a directory starting at a cluster seen before means the tree loops
+    uint8_t visited[65536 / 8] = {0};
+    for (size_t i = 0; i < tree->size; ++i) {
+        if (tree->nodes[i].data == NULL) {
+            continue;
+        }
+        for (size_t offset = 0; offset + 32 <= tree->nodes[i].data_size; offset += 32) {
+            struct SFN *entry = (struct SFN *) (tree->nodes[i].data + offset);
+            if (entry->filename[0] == 0x0) {
+                break;
+            }
+            if (entry->filename[0] == 0xE5 || entry->filename[0] == 0x2E ||
+                (entry->file_attributes & 0x0F) == 0x0F || (entry->file_attributes & 0x08) == 0x08) {
+                continue;
+            }
+
+            struct fat_node_t child = {0};
+            char name[13];
+            sfn_to_name(entry, name);
+            if (snprintf(child.path, sizeof(child.path), "%s\\%s", tree->nodes[i].path, name) >=
+                (int) sizeof(child.path)) {
+                child.path[sizeof(child.path) - 2] = '~';
+            }
+            child.entry = entry;
+            child.parent = i;
+            child.chain = fat_chain_from_table(tree, entry->low_order_address_of_first_cluster);
+            if (child.chain == NULL) {
+                fat_tree_free(tree);
+                return -1;
+            }
+
+            if ((entry->file_attributes & 0x10) == 0x10) {
+                uint16_t first_cluster = entry->low_order_address_of_first_cluster;
+                if (first_cluster >= 2 && (visited[first_cluster / 8] & (1u << (first_cluster % 8))) != 0) {
+                    free(child.chain->clusters);
+                    free(child.chain);
+                    fat_tree_free(tree);
+                    SET_ERRNO(ELOOP);
+                    return -1;
+                }
+                visited[first_cluster / 8] |= (uint8_t) (1u << (first_cluster % 8));
+                child.data_size = child.chain->size * tree->cluster_size;
+                child.data = malloc(child.data_size == 0 ? 1 : child.data_size);
+                if (child.data == NULL ||
+                    fat_read_clusters(volume, child.chain->clusters, child.chain->size, child.data) != 0) {
+                    free(child.data);
+                    free(child.chain->clusters);
+                    free(child.chain);
+                    fat_tree_free(tree);
+                    SET_ERRNO(EINVAL);
+                    return -1;
+                }
+            }
+
+            if (fat_tree_push(tree, &child) != 0) {
+                free(child.data);
+                free(child.chain->clusters);
+                free(child.chain);
+                fat_tree_free(tree);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void fragmentation_add_chain(struct fragmentation_t *pinfo, const struct clusters_chain_t *chain) {
+    if (chain == NULL || chain->size == 0) {
+        return;
+    }
+
+    uint32_t extents = 1;
+    for (size_t i = 1; i < chain->size; ++i) {
+        uint32_t expected = chain->clusters[i - 1] + 1;
+        if (chain->clusters[i] != expected) {
+            extents++;
+            pinfo->seek_distance += chain->clusters[i] > expected ? chain->clusters[i] - expected
+                                                                  : expected - chain->clusters[i];
+        }
+    }
+
+    pinfo->clusters += chain->size;
+    pinfo->extents += extents;
+    if (extents > 1) {
+        pinfo->fragmented++;
+    }
+}
+
+static void fragmentation_finish(struct fragmentation_t *pinfo) {
+    pinfo->average_run_length = pinfo->extents == 0 ? 0.0 : (double) pinfo->clusters / pinfo->extents;
+}
+
+int file_fragmentation(struct file_t *stream, struct fragmentation_t *pinfo) {
+    if (stream == NULL || pinfo == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    memset(pinfo, 0, sizeof(struct fragmentation_t));
+    pinfo->files = 1;
+    fragmentation_add_chain(pinfo, stream->chain);
+    fragmentation_finish(pinfo);
+
+    return 0;
+}
+
+static void fragmentation_add_node(struct fragmentation_t *pinfo, const struct fat_node_t *node) {
+    if (node->data != NULL) {
+        pinfo->directories++;
+    } else {
+        pinfo->files++;
+    }
+    fragmentation_add_chain(pinfo, node->chain);
+}
+
+int fat_fragmentation(struct volume_t *pvolume, struct fragmentation_t *pinfo) {
+    if (pvolume == NULL || pinfo == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    struct fat_tree_t tree;
+    if (fat_tree_load(pvolume, &tree) != 0) {
+        return -1;
+    }
+
+    memset(pinfo, 0, sizeof(struct fragmentation_t));
+    for (size_t i = 1; i < tree.size; ++i) {
+        fragmentation_add_node(pinfo, &tree.nodes[i]);
+    }
+    fragmentation_finish(pinfo);
+
+    fat_tree_free(&tree);
+    return 0;
+}
+
+int fat_fragmentation_print(struct volume_t *pvolume, FILE *stream) {
+    if (pvolume == NULL || stream == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    struct fat_tree_t tree;
+    if (fat_tree_load(pvolume, &tree) != 0) {
+        return -1;
+    }
+
+    struct fragmentation_t total = {0};
+    fprintf(stream, "%-40s %10s %8s %10s %12s\n", "PATH", "CLUSTERS", "EXTENTS", "AVG RUN", "SEEK");
+    for (size_t i = 1; i < tree.size; ++i) {
+        struct fragmentation_t info = {0};
+        fragmentation_add_chain(&info, tree.nodes[i].chain);
+        fragmentation_finish(&info);
+        fprintf(stream, "%-40s %10" PRIu32 " %8" PRIu32 " %10.2f %12" PRIu64 "\n", tree.nodes[i].path,
+                info.clusters, info.extents, info.average_run_length, info.seek_distance);
+        fragmentation_add_node(&total, &tree.nodes[i]);
+    }
+    fragmentation_finish(&total);
+    fat_tree_free(&tree);
+
+    fprintf(stream, "\nfiles: %" PRIu32 ", directories: %" PRIu32 ", fragmented: %" PRIu32 "\n",
+            total.files, total.directories, total.fragmented);
+    fprintf(stream, "clusters: %" PRIu32 ", extents: %" PRIu32 ", average run: %.2f, seek distance: %" PRIu64 "\n",
+            total.clusters, total.extents, total.average_run_length, total.seek_distance);
+
+    return 0;
+}
+
+static int fat_allocate_run(uint16_t *fat, uint32_t max_cluster, uint32_t *next_free, size_t count,
+                            uint16_t *first_cluster) {
+    uint32_t start = *next_free;
+    while (start + count - 1 <= max_cluster) {
+        size_t i = 0;
+        while (i < count && fat[start + i] == 0) {
+            i++;
+        }
+        if (i == count) {
+            for (size_t j = 0; j + 1 < count; ++j) {
+                fat[start + j] = start + j + 1;
+            }
+            fat[start + count - 1] = END_OF_CHAIN_FAT_16;
+            *first_cluster = start;
+            *next_free = start + count;
+            return 0;
+        }
+        // Skip past the bad cluster that broke the run
+        start += i + 1;
+    }
+
+    SET_ERRNO(ENOSPC);
+    return -1;
+}
+
+int fat_defragment(struct volume_t *pvolume, const char *output_file_name) {
+    if (pvolume == NULL || output_file_name == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    // Rewriting the image in place would destroy the source while it is still being read
+    struct stat source;
+    struct stat output;
+    if (pvolume->disk == NULL || pvolume->disk->disk == NULL || fstat(fileno(pvolume->disk->disk), &source) != 0) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+    if (stat(output_file_name, &output) == 0 && output.st_dev == source.st_dev && output.st_ino == source.st_ino) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    struct fat_tree_t tree;
+    if (fat_tree_load(pvolume, &tree) != 0) {
+        return -1;
+    }
+
+    uint16_t *new_fat = calloc(pvolume->super.size_of_fat, pvolume->super.bytes_per_sector);
+    uint8_t *buffer = malloc(DEFRAG_BUFFER_CLUSTERS * tree.cluster_size);
+    if (new_fat == NULL || buffer == NULL) {
+        free(new_fat);
+        free(buffer);
+        fat_tree_free(&tree);
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+    new_fat[0] = tree.fat[0];
+    new_fat[1] = tree.fat[1];
+    for (uint32_t i = 2; i <= tree.max_cluster; ++i) {
+        if (tree.fat[i] == BAD_CLUSTER_FAT_16) {
+            new_fat[i] = BAD_CLUSTER_FAT_16;
+        }
+    }
+
+    // Directories go first so that walking the tree touches the front of the volume only,
+    // then every file gets one contiguous run in breadth first order
+    uint32_t next_free = 2;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t i = 1; i < tree.size; ++i) {
+            struct fat_node_t *node = &tree.nodes[i];
+            if ((node->data != NULL) != (pass == 0) || node->chain->size == 0) {
+                continue;
+            }
+            if (fat_allocate_run(new_fat, tree.max_cluster, &next_free, node->chain->size,
+                                 &node->new_first_cluster) != 0) {
+                free(new_fat);
+                free(buffer);
+                fat_tree_free(&tree);
+                return -1;
+            }
+            node->entry->low_order_address_of_first_cluster = node->new_first_cluster;
+        }
+    }
+
+    for (size_t i = 1; i < tree.size; ++i) {
+        struct fat_node_t *node = &tree.nodes[i];
+        if (node->data == NULL) {
+            continue;
+        }
+        for (size_t offset = 0; offset + 32 <= node->data_size; offset += 32) {
+            struct SFN *entry = (struct SFN *) (node->data + offset);
+            if (entry->filename[0] == 0x0) {
+                break;
+            }
+            if (entry->filename[0] != 0x2E) {
+                continue;
+            }
+            if (entry->filename[1] == ' ') {
+                entry->low_order_address_of_first_cluster = node->new_first_cluster;
+            } else if (entry->filename[1] == 0x2E) {
+                entry->low_order_address_of_first_cluster =
+                        node->parent == 0 ? 0 : tree.nodes[node->parent].new_first_cluster;
+            }
+        }
+    }
+
+    // The image is written next to the output and renamed over it only once it is complete
+    char *temporary_name = malloc(strlen(output_file_name) + sizeof(".XXXXXX"));
+    int fd = -1;
+    if (temporary_name != NULL) {
+        sprintf(temporary_name, "%s.XXXXXX", output_file_name);
+        fd = mkstemp(temporary_name);
+    }
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (fp == NULL) {
+        int error = temporary_name == NULL ? ENOMEM : errno;
+        if (fd >= 0) {
+            close(fd);
+            unlink(temporary_name);
+        }
+        free(temporary_name);
+        free(new_fat);
+        free(buffer);
+        fat_tree_free(&tree);
+        SET_ERRNO(error);
+        return -1;
+    }
+    fchmod(fd, 0644);
+
+    int result = 0;
+    uint16_t reserved = pvolume->super.size_of_reserved_area;
+    uint8_t *reserved_area = calloc(reserved, pvolume->super.bytes_per_sector);
+    if (reserved_area == NULL || disk_read(pvolume->disk, 0, reserved_area, reserved) != reserved ||
+        fwrite(reserved_area, pvolume->super.bytes_per_sector, reserved, fp) != reserved) {
+        result = -1;
+    }
+    free(reserved_area);
+
+    for (int i = 0; result == 0 && i < pvolume->super.number_of_fats; ++i) {
+        if (fwrite(new_fat, pvolume->super.bytes_per_sector, pvolume->super.size_of_fat, fp) !=
+            pvolume->super.size_of_fat) {
+            result = -1;
+        }
+    }
+    if (result == 0 && fwrite(tree.nodes[0].data, pvolume->super.bytes_per_sector, pvolume->root_dir_sectors, fp) !=
+                       pvolume->root_dir_sectors) {
+        result = -1;
+    }
+
+    // Allocation order is cluster order, so the data region is written front to back
+    for (int pass = 0; result == 0 && pass < 2; ++pass) {
+        for (size_t i = 1; result == 0 && i < tree.size; ++i) {
+            struct fat_node_t *node = &tree.nodes[i];
+            if ((node->data != NULL) != (pass == 0) || node->chain->size == 0) {
+                continue;
+            }
+            long position = ((long) pvolume->first_data_sector +
+                             (long) (node->new_first_cluster - 2) * pvolume->super.sectors_per_clusters) *
+                            pvolume->super.bytes_per_sector;
+            if (fseek(fp, position, SEEK_SET) != 0) {
+                result = -1;
+                break;
+            }
+            if (node->data != NULL) {
+                if (fwrite(node->data, tree.cluster_size, node->chain->size, fp) != node->chain->size) {
+                    result = -1;
+                }
+                continue;
+            }
+            for (size_t j = 0; result == 0 && j < node->chain->size; j += DEFRAG_BUFFER_CLUSTERS) {
+                size_t count = node->chain->size - j < DEFRAG_BUFFER_CLUSTERS ? node->chain->size - j
+                                                                              : DEFRAG_BUFFER_CLUSTERS;
+                if (fat_read_clusters(pvolume, node->chain->clusters + j, count, buffer) != 0 ||
+                    fwrite(buffer, tree.cluster_size, count, fp) != count) {
+                    result = -1;
+                }
+            }
+        }
+    }
+
+    // Keep the image as large as the source volume even if its tail is unused
+    long image_size = (long) pvolume->total_sectors * pvolume->super.bytes_per_sector;
+    if (result == 0 && fseek(fp, 0, SEEK_END) == 0 && ftell(fp) < image_size) {
+        if (fseek(fp, image_size - 1, SEEK_SET) != 0 || fputc(0, fp) == EOF) {
+            result = -1;
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(temporary_name, output_file_name) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(temporary_name);
+    }
+    free(temporary_name);
+    free(new_fat);
+    free(buffer);
+    fat_tree_free(&tree);
+
+    if (result != 0) {
+        SET_ERRNO(EIO);
+    }
+    return result;
+}
+
+
+#define PACK_MIN_CLUSTERS 4085
+#define PACK_MAX_CLUSTERS 65524
+#define PACK_MAX_SECTORS_PER_CLUSTER 64
+#define PACK_SECTOR_SIZE 512
+#define PACK_COPY_BUFFER_SIZE (1024 * 1024)
+
+struct pack_node_t {
+    char *host_path;
+    unsigned char name[11];
+    bool is_directory;
+    uint32_t size;
+    time_t modified;
+    size_t parent;
+    size_t first_child;
+    size_t children;
+    uint32_t clusters;
+    uint16_t first_cluster;
+};
+
+struct pack_plan_t {
+    struct pack_node_t *nodes;
+    size_t size;
+    size_t capacity;
+    struct fat_super_t super;
+    uint32_t total_sectors;
+    uint32_t cluster_size;
+    uint32_t root_dir_sectors;
+    uint32_t first_data_sector;
+    int fd;
+    int metadata_error;
+    char failed_path[PATH_MAX]; //Host path the first error is about
+};
+
+static bool pack_valid_char(unsigned char c) {
+    return isalnum(c) || c > 0x7F || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+static int pack_short_name(const char *name, unsigned char *sfn) {
+    memset(sfn, ' ', 11);
+    const char *dot = strrchr(name, '.');
+    size_t base = dot == NULL ? strlen(name) : (size_t) (dot - name);
+    size_t extension = dot == NULL ? 0 : strlen(dot + 1);
+    if (base == 0 || base > 8 || extension > 3 || (dot != NULL && extension == 0)) {
+        SET_ERRNO(ENAMETOOLONG);
+        return -1;
+    }
+
+    for (size_t i = 0; i < base + extension; ++i) {
+        unsigned char c = (unsigned char) (i < base ? name[i] : dot[1 + i - base]);
+        if (!pack_valid_char(c)) {
+            SET_ERRNO(EINVAL);
+            return -1;
+        }
+        sfn[i < base ? i : 8 + i - base] = (unsigned char) toupper(c);
+    }
+    if (sfn[0] == 0xE5) {
+        sfn[0] = 0x05;
+    }
+
+    return 0;
+}
+
+static int pack_fail(struct pack_plan_t *plan, const char *path, int error) {
+    snprintf(plan->failed_path, sizeof(plan->failed_path), "%s", path);
+    SET_ERRNO(error);
+    return -1;
+}
+
+static int pack_compare_names(const void *a, const void *b) {
+    return memcmp(((const struct pack_node_t *) a)->name, ((const struct pack_node_t *) b)->name, 11);
+}
+
+static void pack_plan_free(struct pack_plan_t *plan) {
+    for (size_t i = 0; i < plan->size; ++i) {
+        free(plan->nodes[i].host_path);
+    }
+    free(plan->nodes);
+    plan->nodes = NULL;
+    plan->size = plan->capacity = 0;
+}
+
+static int pack_push(struct pack_plan_t *plan, const struct pack_node_t *node) {
+    if (plan->size == plan->capacity) {
+        size_t capacity = plan->capacity == 0 ? 64 : plan->capacity * 2;
+        struct pack_node_t *nodes = realloc(plan->nodes, capacity * sizeof(struct pack_node_t));
+        if (nodes == NULL) {
+            SET_ERRNO(ENOMEM);
+            return -1;
+        }
+        plan->nodes = nodes;
+        plan->capacity = capacity;
+    }
+    plan->nodes[plan->size++] = *node;
+    return 0;
+}
+
+// Walks the host tree breadth first, so the children of every directory are consecutive nodes
+static int pack_scan(struct pack_plan_t *plan, const char *source_path) {
+    struct stat info;
+    if (stat(source_path, &info) != 0) {
+        return pack_fail(plan, source_path, errno);
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        return pack_fail(plan, source_path, ENOTDIR);
+    }
+
+    struct pack_node_t root = {.host_path = strdup(source_path), .is_directory = true, .modified = info.st_mtime};
+    if (root.host_path == NULL || pack_push(plan, &root) != 0) {
+        free(root.host_path);
+        return pack_fail(plan, source_path, ENOMEM);
+    }
+
+    for (size_t i = 0; i < plan->size; ++i) {
+        if (!plan->nodes[i].is_directory) {
+            continue;
+        }
+        DIR *dir = opendir(plan->nodes[i].host_path);
+        if (dir == NULL) {
+            return pack_fail(plan, plan->nodes[i].host_path, errno);
+        }
+
+        plan->nodes[i].first_child = plan->size;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+
+            struct pack_node_t child = {.parent = i};
+            child.host_path = malloc(strlen(plan->nodes[i].host_path) + strlen(entry->d_name) + 2);
+            if (child.host_path == NULL) {
+                closedir(dir);
+                return pack_fail(plan, plan->nodes[i].host_path, ENOMEM);
+            }
+            sprintf(child.host_path, "%s/%s", plan->nodes[i].host_path, entry->d_name);
+
+            // Symbolic links are followed for files only, so the walk cannot loop. Anything that
+            // cannot be stored is an error rather than a silently incomplete image.
+            int error = 0;
+            bool is_link = false;
+            if (lstat(child.host_path, &info) != 0) {
+                error = errno;
+            } else if ((is_link = S_ISLNK(info.st_mode)) && stat(child.host_path, &info) != 0) {
+                error = errno;
+            } else if (!S_ISREG(info.st_mode) && (!S_ISDIR(info.st_mode) || is_link)) {
+                error = ENOTSUP;
+            } else if (S_ISREG(info.st_mode) && (uint64_t) info.st_size > UINT32_MAX) {
+                error = EFBIG;
+            } else if (pack_short_name(entry->d_name, child.name) != 0) {
+                error = errno;
+            }
+            if (error != 0) {
+                closedir(dir);
+                pack_fail(plan, child.host_path, error);
+                free(child.host_path);
+                return -1;
+            }
+
+            child.is_directory = S_ISDIR(info.st_mode);
+            child.size = child.is_directory ? 0 : (uint32_t) info.st_size;
+            child.modified = info.st_mtime;
+            if (pack_push(plan, &child) != 0) {
+                closedir(dir);
+                pack_fail(plan, child.host_path, ENOMEM);
+                free(child.host_path);
+                return -1;
+            }
+        }
+        closedir(dir);
+
+        struct pack_node_t *children = plan->nodes + plan->nodes[i].first_child;
+        plan->nodes[i].children = plan->size - plan->nodes[i].first_child;
+        qsort(children, plan->nodes[i].children, sizeof(struct pack_node_t), pack_compare_names);
+        for (size_t j = 1; j < plan->nodes[i].children; ++j) {
+            if (memcmp(children[j - 1].name, children[j].name, 11) == 0) {
+                return pack_fail(plan, children[j].host_path, EEXIST);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t pack_node_clusters(const struct pack_node_t *node, uint32_t cluster_size) {
+    // Subdirectories hold '.' and '..' in front of their children
+    uint64_t bytes = node->is_directory ? (node->children + 2) * 32 : node->size;
+    return (uint32_t) ((bytes + cluster_size - 1) / cluster_size);
+}
+
+// This reader fetches one cluster per disk read, so the default is the largest cluster that keeps
+// the count within FAT16 limits. Smaller trees are padded up to the FAT16 minimum cluster count;
+// the padding is never written, so the image stays sparse on the host.
+static int pack_geometry(struct pack_plan_t *plan, const struct pack_options_t *options) {
+    // Rounded up to whole sectors, in a wider type so that the largest requests cannot wrap to 0
+    uint32_t root_entries = options != NULL && options->root_entries != 0 ? options->root_entries : 512;
+    root_entries = (root_entries + 15) & ~15u;
+    if (root_entries > UINT16_MAX) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (plan->nodes[0].children > root_entries) {
+        SET_ERRNO(ENOSPC);
+        return -1;
+    }
+
+    uint8_t fixed = options != NULL ? options->sectors_per_cluster : 0;
+    if (fixed != 0 && (fixed > PACK_MAX_SECTORS_PER_CLUSTER || (fixed & (fixed - 1)) != 0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    uint8_t sectors_per_cluster = 0;
+    uint64_t clusters = 0;
+    for (uint8_t candidate = PACK_MAX_SECTORS_PER_CLUSTER; candidate >= 1; candidate /= 2) {
+        if (fixed != 0 && candidate != fixed) {
+            continue;
+        }
+        uint64_t needed = 0;
+        for (size_t i = 1; i < plan->size; ++i) {
+            needed += pack_node_clusters(&plan->nodes[i], candidate * PACK_SECTOR_SIZE);
+        }
+        if (needed <= PACK_MAX_CLUSTERS) {
+            sectors_per_cluster = candidate;
+            clusters = needed < PACK_MIN_CLUSTERS ? PACK_MIN_CLUSTERS : needed;
+        }
+        break;
+    }
+    if (sectors_per_cluster == 0) {
+        SET_ERRNO(ENOSPC);
+        return -1;
+    }
+
+    plan->cluster_size = sectors_per_cluster * PACK_SECTOR_SIZE;
+    plan->root_dir_sectors = root_entries * 32 / PACK_SECTOR_SIZE;
+    uint16_t size_of_fat = (uint16_t) (((clusters + 2) * 2 + PACK_SECTOR_SIZE - 1) / PACK_SECTOR_SIZE);
+    plan->first_data_sector = 1 + 2 * size_of_fat + plan->root_dir_sectors;
+    plan->total_sectors = plan->first_data_sector + (uint32_t) clusters * sectors_per_cluster;
+
+    struct fat_super_t *super = &plan->super;
+    memset(super, 0, sizeof(struct fat_super_t));
+    memcpy(super->unused, "\xEB\x3C\x90", 3);
+    memcpy(super->name, "MSWIN4.1", 8);
+    super->bytes_per_sector = PACK_SECTOR_SIZE;
+    super->sectors_per_clusters = sectors_per_cluster;
+    super->size_of_reserved_area = 1;
+    super->number_of_fats = 2;
+    super->maximum_number_of_files = (uint16_t) root_entries;
+    super->number_of_sectors = plan->total_sectors <= UINT16_MAX ? (uint16_t) plan->total_sectors : 0;
+    super->media_type = 0xF8;
+    super->size_of_fat = size_of_fat;
+    super->sectors_per_track = 32;
+    super->number_of_heads = 64;
+    super->number_of_sectors_in_filesystem = plan->total_sectors <= UINT16_MAX ? 0 : plan->total_sectors;
+    super->drive_number = 0x80;
+    super->boot_signature = 0x29;
+    super->serial_number = (uint32_t) time(NULL);
+    if (options != NULL && options->label[0] != '\0') {
+        memcpy(super->label, options->label, 11);
+    } else {
+        memcpy(super->label, "NO NAME    ", 11);
+    }
+    memcpy(super->type, "FAT16   ", 8);
+    super->signature = 0xAA55;
+
+    return 0;
+}
+
+// Directories are placed first, then every file as one run, both in breadth first order
+static void pack_allocate(struct pack_plan_t *plan) {
+    uint32_t next_free = 2;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t i = 1; i < plan->size; ++i) {
+            struct pack_node_t *node = &plan->nodes[i];
+            if (node->is_directory != (pass == 0)) {
+                continue;
+            }
+            node->clusters = pack_node_clusters(node, plan->cluster_size);
+            node->first_cluster = node->clusters == 0 ? 0 : (uint16_t) next_free;
+            next_free += node->clusters;
+        }
+    }
+}
+
+static void pack_fill_entry(struct SFN *entry, const unsigned char *name, uint8_t attributes,
+                            uint16_t first_cluster, uint32_t size, time_t modified) {
+    memset(entry, 0, sizeof(struct SFN));
+    memcpy(entry->filename, name, 8);
+    memcpy(entry->extension, name + 8, 3);
+    entry->file_attributes = attributes;
+    entry->low_order_address_of_first_cluster = first_cluster;
+    entry->size = size;
+
+    struct tm date;
+    if (localtime_r(&modified, &date) == NULL || date.tm_year < 80) {
+        return;
+    }
+    entry->modified_time.hours = date.tm_hour;
+    entry->modified_time.minutes = date.tm_min;
+    entry->modified_time.seconds = date.tm_sec / 2;
+    entry->modified_date.year = date.tm_year - 80;
+    entry->modified_date.month = date.tm_mon + 1;
+    entry->modified_date.day = date.tm_mday;
+    entry->creation_time = entry->modified_time;
+    entry->creation_date = entry->modified_date;
+    entry->access_date = (uint16_t) (((date.tm_year - 80) << 9) | ((date.tm_mon + 1) << 5) | date.tm_mday);
+}
+
+static int pack_pwrite(int fd, const void *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, buffer, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer = (const uint8_t *) buffer + written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+static off_t pack_cluster_offset(const struct pack_plan_t *plan, uint16_t cluster) {
+    return ((off_t) plan->first_data_sector + (off_t) (cluster - 2) * plan->super.sectors_per_clusters) *
+           PACK_SECTOR_SIZE;
+}
+
+static int pack_write_directory(const struct pack_plan_t *plan, size_t index, uint8_t *buffer) {
+    const struct pack_node_t *dir = &plan->nodes[index];
+    struct SFN *entries = (struct SFN *) buffer;
+    size_t count = 0;
+
+    if (index != 0) {
+        uint16_t parent_cluster = dir->parent == 0 ? 0 : plan->nodes[dir->parent].first_cluster;
+        pack_fill_entry(&entries[count++], (const unsigned char *) ".          ", 0x10, dir->first_cluster, 0,
+                        dir->modified);
+        pack_fill_entry(&entries[count++], (const unsigned char *) "..         ", 0x10, parent_cluster, 0,
+                        dir->modified);
+    }
+    for (size_t i = 0; i < dir->children; ++i) {
+        const struct pack_node_t *child = &plan->nodes[dir->first_child + i];
+        pack_fill_entry(&entries[count++], child->name, child->is_directory ? 0x10 : 0x20, child->first_cluster,
+                        child->size, child->modified);
+    }
+
+    if (index == 0) {
+        off_t root_dir = (off_t) (1 + 2 * plan->super.size_of_fat) * PACK_SECTOR_SIZE;
+        return pack_pwrite(plan->fd, buffer, plan->root_dir_sectors * PACK_SECTOR_SIZE, root_dir);
+    }
+    return pack_pwrite(plan->fd, buffer, (size_t) dir->clusters * plan->cluster_size,
+                       pack_cluster_offset(plan, dir->first_cluster));
+}
+
+static int pack_write_metadata(const struct pack_plan_t *plan) {
+    size_t fat_bytes = (size_t) plan->super.size_of_fat * PACK_SECTOR_SIZE;
+    uint16_t *fat = calloc(1, fat_bytes);
+    if (fat == NULL) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+    fat[0] = 0xFF00 | plan->super.media_type;
+    fat[1] = END_OF_CHAIN_FAT_16;
+    for (size_t i = 1; i < plan->size; ++i) {
+        const struct pack_node_t *node = &plan->nodes[i];
+        for (uint32_t j = 0; j < node->clusters; ++j) {
+            fat[node->first_cluster + j] = j + 1 == node->clusters ? END_OF_CHAIN_FAT_16 : node->first_cluster + j + 1;
+        }
+    }
+
+    int result = pack_pwrite(plan->fd, &plan->super, sizeof(struct fat_super_t), 0);
+    for (int i = 0; result == 0 && i < plan->super.number_of_fats; ++i) {
+        result = pack_pwrite(plan->fd, fat, fat_bytes, (off_t) (1 + i * plan->super.size_of_fat) * PACK_SECTOR_SIZE);
+    }
+    free(fat);
+
+    size_t largest = plan->root_dir_sectors * PACK_SECTOR_SIZE;
+    for (size_t i = 1; i < plan->size; ++i) {
+        if (plan->nodes[i].is_directory && (size_t) plan->nodes[i].clusters * plan->cluster_size > largest) {
+            largest = (size_t) plan->nodes[i].clusters * plan->cluster_size;
+        }
+    }
+    uint8_t *buffer = malloc(largest);
+    if (buffer == NULL) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+    for (size_t i = 0; result == 0 && i < plan->size; ++i) {
+        if (plan->nodes[i].is_directory) {
+            memset(buffer, 0, largest);
+            result = pack_write_directory(plan, i, buffer);
+        }
+    }
+    free(buffer);
+
+    return result;
+}
+
+static void *pack_metadata_thread(void *arg) {
+    struct pack_plan_t *plan = arg;
+    plan->metadata_error = pack_write_metadata(plan) == 0 ? 0 : errno;
+    return NULL;
+}
+
+static int pack_copy_file(const struct pack_plan_t *plan, const struct pack_node_t *node, uint8_t **buffer) {
+    int source = open(node->host_path, O_RDONLY);
+    if (source < 0) {
+        return -1;
+    }
+
+    off_t output_offset = pack_cluster_offset(plan, node->first_cluster);
+    size_t remaining = node->size;
+    bool in_kernel = true;
+    while (remaining > 0) {
+        ssize_t copied;
+        if (in_kernel) {
+            copied = copy_file_range(source, NULL, plan->fd, &output_offset, remaining, 0);
+            if (copied < 0 && errno != EINTR && remaining == node->size) {
+                // Filesystems that cannot copy between these files fall back to plain reads and writes
+                in_kernel = false;
+                continue;
+            }
+        } else {
+            if (*buffer == NULL && (*buffer = malloc(PACK_COPY_BUFFER_SIZE)) == NULL) {
+                close(source);
+                SET_ERRNO(ENOMEM);
+                return -1;
+            }
+            copied = read(source, *buffer, remaining < PACK_COPY_BUFFER_SIZE ? remaining : PACK_COPY_BUFFER_SIZE);
+            if (copied > 0 && pack_pwrite(plan->fd, *buffer, copied, output_offset) != 0) {
+                close(source);
+                return -1;
+            }
+            if (copied > 0) {
+                output_offset += copied;
+            }
+        }
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            // The file shrank since it was scanned
+            close(source);
+            if (copied == 0) {
+                SET_ERRNO(EIO);
+            }
+            return -1;
+        }
+        remaining -= copied;
+    }
+
+    close(source);
+    return 0;
+}
+
+static int pack_finish(struct pack_plan_t *plan, int error, char *failed_path, size_t failed_path_size) {
+    if (failed_path != NULL && failed_path_size != 0) {
+        snprintf(failed_path, failed_path_size, "%s", error != 0 ? plan->failed_path : "");
+    }
+    pack_plan_free(plan);
+    free(plan);
+
+    if (error != 0) {
+        SET_ERRNO(error);
+        return -1;
+    }
+    return 0;
+}
+
+int fat_pack(const char *source_path, const char *volume_file_name, const struct pack_options_t *options,
+             char *failed_path, size_t failed_path_size) {
+    if (source_path == NULL || volume_file_name == NULL) {
+        SET_ERRNO(EFAULT);
+        return -1;
+    }
+
+    struct pack_plan_t *plan = calloc(1, sizeof(struct pack_plan_t));
+    if (plan == NULL) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+    if (pack_scan(plan, source_path) != 0) {
+        return pack_finish(plan, errno, failed_path, failed_path_size);
+    }
+    if (pack_geometry(plan, options) != 0) {
+        pack_fail(plan, source_path, errno);
+        return pack_finish(plan, errno, failed_path, failed_path_size);
+    }
+    pack_allocate(plan);
+
+    plan->fd = open(volume_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (plan->fd < 0) {
+        pack_fail(plan, volume_file_name, errno);
+        return pack_finish(plan, errno, failed_path, failed_path_size);
+    }
+    if (ftruncate(plan->fd, (off_t) plan->total_sectors * PACK_SECTOR_SIZE) != 0) {
+        int error = errno;
+        close(plan->fd);
+        pack_fail(plan, volume_file_name, error);
+        return pack_finish(plan, error, failed_path, failed_path_size);
+    }
+
+    // Boot sector, FATs and directories are built by a second thread while this one streams the
+    // file data; both write disjoint parts of the image
+    pthread_t metadata;
+    bool threaded = pthread_create(&metadata, NULL, pack_metadata_thread, plan) == 0;
+    if (!threaded) {
+        pack_metadata_thread(plan);
+    }
+
+    int error = 0;
+    uint8_t *buffer = NULL;
+    for (size_t i = 1; error == 0 && i < plan->size; ++i) {
+        if (!plan->nodes[i].is_directory && plan->nodes[i].clusters != 0 &&
+            pack_copy_file(plan, &plan->nodes[i], &buffer) != 0) {
+            error = errno;
+            pack_fail(plan, plan->nodes[i].host_path, error);
+        }
+    }
+    free(buffer);
+
+    if (threaded) {
+        pthread_join(metadata, NULL);
+    }
+    if (error == 0 && plan->metadata_error != 0) {
+        error = plan->metadata_error;
+        pack_fail(plan, volume_file_name, error);
+    }
+    if (close(plan->fd) != 0 && error == 0) {
+        error = errno;
+        pack_fail(plan, volume_file_name, error);
+    }
+
+    return pack_finish(plan, error, failed_path, failed_path_size);
+}
@@ -11,9 +11,13 @@
 #include <assert.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <limits.h>
 
 #define EOC_FAT_16 0xFFF8
 
+#define END_OF_CHAIN_FAT_16 0xFFFF
+
 #define BAD_CLUSTER_FAT_16 0xFFF7
 
 struct clusters_chain_t {
@@ -82,8 +86,54 @@ struct fat_super_t {
     uint16_t signature; //Signature value (0xaa55)
 }__attribute__ (( packed ));
 
+#define TRACE_MAGIC "FATTRACE"
+
+#define TRACE_VERSION 1
+
+enum trace_op_t {
+    TRACE_DISK_READ = 1,
+    TRACE_FILE_OPEN = 2,
+    TRACE_FILE_READ = 3,
+    TRACE_FILE_SEEK = 4,
+    TRACE_DIR_READ = 5
+};
+
+struct trace_header_t {
+    char magic[8]; //TRACE_MAGIC, not terminated
+    uint32_t version; //TRACE_VERSION
+    uint32_t record_size; //Size of every trace_record_t that follows the header
+}__attribute__ (( packed ));
+
+struct trace_record_t {
+    uint8_t op; //One of trace_op_t
+    uint8_t whence; //Origin of file_seek, 0 for other operations
+    uint16_t handle; //Stream the operation was made on, 0 for disk reads
+    int32_t first; //First sector for disk_read, first cluster for file_open, element size for file_read, offset for file_seek
+    int32_t count; //Sectors for disk_read, file size for file_open, number of elements for file_read
+    int32_t result; //Value returned by the call (0 or -1 for the *_open calls)
+    uint64_t timestamp; //Start of the call, in nanoseconds since the trace was opened
+    uint32_t duration; //Duration of the call, in nanoseconds
+}__attribute__ (( packed ));
+
+struct trace_t {
+    FILE *trace;
+    uint64_t start;
+    uint64_t records;
+    uint64_t dropped; //Records that could not be written, trace_close fails with EIO when there are any
+    uint32_t attached; //Disks recording into this trace, trace_close fails with EBUSY while there are any
+    uint16_t next_handle;
+};
+
+struct trace_t *trace_open(const char *trace_file_name);
+
+int trace_close(struct trace_t *ptrace);
+
+uint64_t trace_clock(void);
+
+
 struct disk_t {
     FILE *disk;
+    struct trace_t *trace;
 };
 
 struct disk_t *disk_open_from_file(const char *volume_file_name);
@@ -92,6 +142,12 @@ int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t
 
 int disk_close(struct disk_t *pdisk);
 
+// Attaches ptrace to the disk, or detaches the current trace when ptrace is NULL. A trace has to be
+// detached from every disk, or the disks closed, before trace_close.
+int disk_set_trace(struct disk_t *pdisk, struct trace_t *ptrace);
+
+
+struct file_t;
 
 struct volume_t {
     struct disk_t *disk;
@@ -103,7 +159,7 @@ struct volume_t {
     uint16_t sectors_per_fat;
     uint16_t root_dir_capacity;
 
-    uint16_t total_sectors;
+    uint32_t total_sectors;
     uint32_t fat_size;
     uint16_t root_dir_sectors;
     uint16_t first_data_sector;
@@ -111,12 +167,18 @@ struct volume_t {
     uint32_t data_sectors;
     uint32_t total_clusters;
     uint16_t bytes_per_cluster;
+    uint8_t cluster_shift; //log2 of the cluster size in bytes, 0 when the cluster size is not a power of two
+
+    size_t (*file_read)(void *ptr, size_t size, size_t nmemb, struct file_t *stream); //Picked for the volume geometry
+    int32_t (*file_seek)(struct file_t *stream, int32_t offset, int whence); //Picked for the volume geometry
 };
 
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector);
 
 int fat_close(struct volume_t *pvolume);
 
+int fat_select_fast_path(struct volume_t *pvolume, bool specialized);
+
 
 struct file_t {
     unsigned char filename[8];
@@ -139,6 +201,7 @@ struct file_t {
     uint32_t file_offset;
     uint32_t cluster_offset;
     bool end_of_file;
+    uint16_t handle;
 };
 
 struct file_t *file_open(struct volume_t *pvolume, const char *file_name);
@@ -172,6 +235,7 @@ struct dir_t {
     uint32_t cluster_offset;
     uint32_t dir_offset;
     bool end_of_file;
+    uint16_t handle;
 };
 struct dir_entry_t {
     char name[20];
@@ -191,4 +255,33 @@ int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry);
 
 int dir_close(struct dir_t *pdir);
 
+
+struct fragmentation_t {
+    uint32_t files; //Number of regular files taken into account
+    uint32_t directories; //Number of subdirectories taken into account (root directory has no chain)
+    uint32_t fragmented; //Files and directories made of more than one extent
+    uint32_t clusters; //Clusters occupied by the data
+    uint32_t extents; //Runs of consecutive clusters
+    double average_run_length; //Average extent length, in clusters
+    uint64_t seek_distance; //Sum of clusters jumped over when moving from one extent to the next
+};
+
+int file_fragmentation(struct file_t *stream, struct fragmentation_t *pinfo);
+
+int fat_fragmentation(struct volume_t *pvolume, struct fragmentation_t *pinfo);
+
+int fat_fragmentation_print(struct volume_t *pvolume, FILE *stream);
+
+int fat_defragment(struct volume_t *pvolume, const char *output_file_name);
+
+
+struct pack_options_t {
+    uint8_t sectors_per_cluster; //0 picks the largest cluster that still gives a valid FAT16 cluster count
+    uint16_t root_entries; //Capacity of the root directory, 0 for 512
+    char label[11]; //Volume label, padded with spaces
+};
+
+int fat_pack(const char *source_path, const char *volume_file_name, const struct pack_options_t *options,
+             char *failed_path, size_t failed_path_size);
+
 #endif //FAT_DANTE_FILE_READER_H